@@ -0,0 +1,171 @@
+#!/bin/sh
+# Benchmarks linux_shell against the original version (the first commit).
+# The shell has no batch mode, so each run starts a window on a virtual X
+# display, types a command line followed by `exit` and times how long the
+# window takes to go away. A run of `true` is timed the same way and taken
+# off, which leaves the command itself.
+#
+#   ./bench.sh flood [lines]    output rendering, `seq 1 lines` (5000000)
+#   ./bench.sh pipe [lines]     pipeline throughput, `cat file | wc -l` on a
+#                               file of `lines` lines (20000000) and a 2 GiB
+#                               `dd | wc -c`, against /bin/sh
+#
+# Needs Xvfb and xdotool (apt install xvfb xdotool) besides the build deps.
+
+set -e
+cd "$(dirname "$0")"
+
+WORK=${TMPDIR:-/tmp}/linux_shell_bench
+CFLAGS="-O2 $(pkg-config --cflags --libs gtk+-3.0) -lcurl -lm"
+
+build()
+{
+    mkdir -p "$WORK/base" "$WORK/home"
+    gcc -o "$WORK/new" v3.c lexer.c history.c tinyexpr.c $CFLAGS -ldl
+    git archive "$(git rev-list --max-parents=0 HEAD)" | tar -x -C "$WORK/base"
+    (cd "$WORK/base" && gcc -o "$WORK/old" v3.c tinyexpr.c $CFLAGS)
+}
+
+start_display()
+{
+    if [ -z "$DISPLAY" ]; then
+        Xvfb :77 -screen 0 1280x1024x24 >/dev/null 2>&1 &
+        XVFB_PID=$!
+        trap 'kill $XVFB_PID' EXIT
+        export DISPLAY=:77
+        sleep 1
+    fi
+}
+
+now()
+{
+    date +%s.%N
+}
+
+# Number of processes below `pid`: the exec broker and whatever runs.
+descendants()
+{
+    ps -e -o pid= -o ppid= | awk -v root="$1" '
+        { parent[$1] = $2 }
+        END {
+            for (p in parent)
+                for (q = parent[p]; q > 1; q = parent[q])
+                    if (q == root) { n++; break }
+            print n + 0
+        }'
+}
+
+# Prints the seconds `binary` takes to run `line` and exit, window start
+# excluded. HOME is a scratch directory so no history or plugins are used.
+# The new shell takes `line; exit`. The original has no `;` and handles
+# keys while a command runs, so it gets `exit` once the command's processes
+# are gone.
+run_line()
+{
+    HOME="$WORK/home" "$WORK/$1" >/dev/null 2>&1 &
+    pid=$!
+    xdotool search --sync --name HorizonShell windowfocus --sync >/dev/null
+    before=$(descendants $pid)
+    start=$(now)
+    if [ "$1" = new ]; then
+        xdotool type --delay 0 "$2; exit
+"
+    else
+        xdotool type --delay 0 "$2
+"
+        sleep 0.05
+        while [ "$(descendants $pid)" -gt "$before" ]; do
+            sleep 0.01
+        done
+        xdotool type --delay 0 "exit
+"
+    fi
+    wait $pid
+    end=$(now)
+    echo "$start $end" | awk '{ printf "%.3f\n", $2 - $1 }'
+}
+
+# Seconds spent in `line` itself: the best of three runs, less the best of
+# three runs of `true`.
+time_line()
+{
+    best=
+    idle=
+    for i in 1 2 3; do
+        t=$(run_line "$1" "$2")
+        best=$(echo "$t ${best:-$t}" | awk '{ print ($1 < $2) ? $1 : $2 }')
+        t=$(run_line "$1" true)
+        idle=$(echo "$t ${idle:-$t}" | awk '{ print ($1 < $2) ? $1 : $2 }')
+    done
+    echo "$best $idle" | awk '{ d = $1 - $2; printf "%.3f\n", d > 0.001 ? d : 0.001 }'
+}
+
+flood()
+{
+    lines=${1:-5000000}
+    echo "seq 1 $lines at $(git rev-parse --short HEAD), lines/sec:"
+    old=$(time_line old "seq 1 $lines")
+    new=$(time_line new "seq 1 $lines")
+    echo "$old $new $lines" | awk '{
+        printf "  old  %12.0f  (%.2f s)\n", $3 / $1, $1
+        printf "  new  %12.0f  (%.2f s)  %.1fx\n", $3 / $2, $2, $1 / $2
+    }'
+}
+
+# Best of three runs of `line` under /bin/sh, in seconds.
+time_sh()
+{
+    best=
+    for i in 1 2 3; do
+        start=$(now)
+        sh -c "$1" >/dev/null
+        t=$(echo "$start $(now)" | awk '{ printf "%.3f\n", $2 - $1 }')
+        best=$(echo "$t ${best:-$t}" | awk '{ print ($1 < $2) ? $1 : $2 }')
+    done
+    echo "$best"
+}
+
+# The original shell has no pipes, so it runs the same line through sh,
+# which is how pipelines were run in it. `cat` is left as a user types it,
+# so the new shell picks between its builtin and the program as it would.
+pipe()
+{
+    lines=${1:-20000000}
+    big="$WORK/big"
+    yes 'the quick brown fox jumps over the lazy dog' | head -n "$lines" >"$big"
+    echo "at $(git rev-parse --short HEAD):"
+    for line in "cat $big | wc -l" "dd if=/dev/zero bs=64k count=32768 status=none | wc -c"; do
+        case "$line" in
+        dd*) bytes=2147483648 ;;
+        *) bytes=$(wc -c <"$big") ;;
+        esac
+        echo "$line" >"$WORK/pipe.sh"
+        echo "$line, MB/s:"
+        sh=$(time_sh "$line")
+        old=$(time_line old "sh $WORK/pipe.sh")
+        new=$(time_line new "$line")
+        echo "$sh $old $new $bytes" | awk '{
+            printf "  sh   %12.0f  (%.2f s)\n", $4 / $1 / 1048576, $1
+            printf "  old  %12.0f  (%.2f s)\n", $4 / $2 / 1048576, $2
+            printf "  new  %12.0f  (%.2f s)  %.1fx old\n", $4 / $3 / 1048576, $3, $2 / $3
+        }'
+    done
+    rm -f "$big"
+}
+
+case "$1" in
+flood)
+    build
+    start_display
+    flood "$2"
+    ;;
+pipe)
+    build
+    start_display
+    pipe "$2"
+    ;;
+*)
+    echo "usage: $0 flood|pipe [lines]" >&2
+    exit 2
+    ;;
+esac
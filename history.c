@@ -0,0 +1,1045 @@
+#define _GNU_SOURCE // memrchr, memmem
+#include "history.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib-unix.h>
+#include <math.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HISTORY_FLUSH_MS 1000     // Lines typed within this share one write()
+#define HISTORY_SYNC_MS 10000     // fdatasync() at most this often
+#define HISTORY_FLUSH_BYTES 65536 // Write at once past this much
+#define HISTORY_INDEX_US 4000     // Indexing time per idle callback
+#define HISTORY_MERGE_CHUNK 65536 // Bytes read per pread() of peers' lines
+#define HISTORY_TAIL_ID (1u << 31)
+#define HISTORY_TAIL_SLACK 64 // Freed `tail` slots worth renumbering for
+#define HISTORY_SUGGEST_HALF_LIFE 200.0 // Commands after which a use counts half
+#define HISTORY_SUGGEST_LINES 10000     // Newest lines of the file feeding suggestions,
+                                        // and best lines kept when they are trimmed
+
+// Postings keys. Bigrams are only looked up for two-byte queries.
+#define HISTORY_TRIGRAM(s) (((guint)(guchar)(s)[0] << 16) | ((guint)(guchar)(s)[1] << 8) | (guchar)(s)[2])
+#define HISTORY_BIGRAM(s) ((1u << 24) | ((guint)(guchar)(s)[0] << 8) | (guchar)(s)[1])
+
+// Search postings: the ids of the lines holding one trigram. Lines added
+// since opening get ids counting up from HISTORY_TAIL_ID, and lines indexed
+// from the file ids counting down from just below it, so ids grow with
+// time. The file is indexed newest first, which makes `older` a list of
+// falling ids; it is stored as varint gaps since it holds nearly
+// everything, and dense ids keep the gaps short. Both halves are walked
+// newest first.
+// A line's score sums 2^(t / half-life) over the times t it was used,
+// counted in commands, so it grows with use and recent uses weigh more.
+// Only ratios between scores matter, and those never change as time goes
+// on, so a node's best line can only be overtaken by one just used. The
+// sum is kept as its log2 so it can't overflow.
+typedef struct
+{
+    const char *text;
+    double score;
+} HistoryScore;
+
+typedef struct
+{
+    guint32 child; // First child, 0 if none (the root is nobody's child)
+    guint32 next;  // Next sibling
+    guint32 best;  // Index in `scores`, G_MAXUINT32 if no line goes past
+    guchar byte;
+} HistoryTrieNode;
+
+typedef struct
+{
+    guint64 start, end;
+} HistoryRange;
+
+typedef struct
+{
+    GArray *newer;      // guint32, rising
+    GByteArray *older;  // Gaps between falling ids, the first from G_MAXUINT32
+    guint32 older_last; // Last id in `older`
+    guint n;
+} HistoryPostings;
+
+// The file is one command per line. At startup it is mapped read-only and
+// read backwards from the end, only as far as the newest entries, which are
+// copied into `texts`. Nothing is ever written to the mapping, so its pages
+// stay shared with the page cache. The search index refers to older lines
+// by their offset in it; such a line ends at its '\n', not at a NUL, which
+// history_line_hash() and history_line_len() allow for. Lines added later
+// are copies kept in `tail`, and freed as soon as they leave the ring. The
+// slots they leave in `tail` are squeezed out, and the search postings
+// renumbered to match, once they are half of it.
+//
+// Another window can truncate the file while it is mapped, and touching a
+// page past its new end raises SIGBUS. So the map is checked against the
+// file's size before each use and dropped for good once the file is
+// shorter; from then on search only finds lines added since opening.
+//
+// Every shell window appends to the same file. inotify says when it grows,
+// and the new bytes past `read_pos` are read and merged as if typed here,
+// skipping the ranges this process wrote itself. Nothing takes a lock:
+// each batch is one O_APPEND write(), which the kernel keeps whole.
+//
+// Entries live in a ring of `cap` slots. Position 0 is the oldest, at slot
+// `head`; when the ring is full the oldest is dropped to make room. An
+// entry erased as a duplicate leaves a NULL hole where it was, so nothing
+// moves; the holes are squeezed out once they fill a quarter of the ring.
+// `index` maps each text to the slot of its newest copy.
+struct History
+{
+    int fd;              // O_RDWR | O_APPEND, -1 if the file can't be written
+    int inotify_fd;      // -1 when not watching for other windows
+    guint inotify_id;
+    guint64 read_pos;    // End of the last whole line seen in the file
+    GArray *own;         // HistoryRange written by this process, past read_pos
+    const char *map;     // The file as it was when opened, NULL if empty or dropped
+    gsize map_len;
+    int map_fd;          // The mapped file, kept open to watch its size
+    gsize scan_pos;      // Start of the oldest line read from the map so far
+    guint lines_read;    // Lines read from the map so far, repeats included
+    GPtrArray *tail;     // Lines added since opening, owned; NULL once out of the ring
+    GHashTable *tail_ids; // Line in `tail` -> its index + 1
+    guint tail_freed;    // NULL slots in `tail`
+    GStringChunk *texts; // Copies of file lines in the ring
+    char **ring;         // `cap` slots: in `texts`, in `tail`, or NULL
+    guint cap;
+    guint head;
+    guint count;         // Positions in use, holes included
+    guint live;          // Entries, holes not included
+    guint cursor;        // Position shown by Up/Down; `count` when none
+    GHashTable *index;   // Entry text -> slot + 1
+    HistoryDups dups;
+
+    // Ctrl+R. The file is indexed in idle time after the ring is loaded,
+    // newest lines first; only the newest copy of a line is indexed.
+    GHashTable *grams;          // Trigram or bigram -> HistoryPostings
+    HistoryPostings all;        // Every indexed line, for one-byte queries
+    GHashTable *indexed;        // Texts indexed so far
+    GArray *lines;              // guint32 map offset of each indexed line
+    guint index_id;
+    char *query;
+    gsize query_len;
+    HistoryPostings *results;   // Postings walked for `query`, NULL if none
+    guint results_newer;        // Next in results->newer is the one before this
+    gsize results_older;        // Next gap in results->older
+    guint32 results_id;         // Last id read from results->older
+    GHashTable *shown;          // Texts already returned for `query`
+    char *found;                // Copy of the last one returned
+
+    // Suggestions: a byte trie over the recent lines, each node caching
+    // the best scoring line that goes on past it.
+    GArray *trie;               // HistoryTrieNode, the root first
+    GArray *scores;             // HistoryScore per distinct line
+    GHashTable *scored;         // Text -> index in `scores` + 1
+    GStringChunk *scored_texts; // Copies of the lines in `scores`
+    gint64 uses;                // Lines added since opening
+
+    GString *pending;    // Lines not yet written
+    guint flush_id;
+    guint sync_id;
+    gboolean unsynced;   // Written since the last fdatasync()
+};
+
+//--- Lines ---//
+
+// A line is either in the map, ending at its '\n', or a string of its own.
+static gsize history_line_len(const char *line)
+{
+    return strcspn(line, "\n");
+}
+
+// g_str_hash() and g_str_equal() for lines of either kind.
+static guint history_line_hash(gconstpointer key)
+{
+    guint hash = 5381;
+    for (const guchar *p = key; *p && *p != '\n'; p++)
+        hash = hash * 33 + *p;
+    return hash;
+}
+
+static gboolean history_line_equal(gconstpointer a, gconstpointer b)
+{
+    gsize len = history_line_len(a);
+    return len == history_line_len(b) && memcmp(a, b, len) == 0;
+}
+
+// Returns the line that ends just before scan_pos and moves scan_pos to
+// its start. Empty lines are skipped; NULL at the top.
+static const char *history_prev_line(History *hist)
+{
+    while (hist->scan_pos > 0)
+    {
+        gsize end = hist->scan_pos - 1; // Its '\n'
+        const char *nl = memrchr(hist->map, '\n', end);
+        gsize start = nl ? (gsize)(nl - hist->map) + 1 : 0;
+        hist->scan_pos = start;
+        if (end > start)
+            return hist->map + start;
+    }
+    return NULL;
+}
+
+static void history_map_file(History *hist, const char *path)
+{
+    hist->map_fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (hist->map_fd == -1)
+        return;
+    if (fstat(hist->map_fd, &st) == 0 && st.st_size > 0)
+    {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, hist->map_fd, 0);
+        if (map != MAP_FAILED)
+        {
+            hist->map = map;
+            hist->map_len = st.st_size;
+            // A last line without '\n' is an interrupted write: leave it out.
+            const char *last_nl = memrchr(hist->map, '\n', hist->map_len);
+            hist->scan_pos = last_nl ? (gsize)(last_nl - hist->map) + 1 : 0;
+            hist->read_pos = hist->scan_pos;
+            return;
+        }
+    }
+    close(hist->map_fd);
+    hist->map_fd = -1;
+}
+
+// Empties a set of lines and puts back those not in the map. Neither step
+// hashes or compares the lines it drops, which could no longer be read.
+static void history_drop_map_lines(const History *hist, GHashTable *set)
+{
+    guint n;
+    gpointer *lines = g_hash_table_get_keys_as_array(set, &n);
+    g_hash_table_remove_all(set);
+    for (guint i = 0; i < n; i++)
+        if ((const char *)lines[i] < hist->map || (const char *)lines[i] >= hist->map + hist->map_len)
+            g_hash_table_add(set, lines[i]);
+    g_free(lines);
+}
+
+// TRUE if the map can still be read. Once the file is shorter than the map
+// it is unmapped, along with every pointer into it.
+static gboolean history_map_usable(History *hist)
+{
+    struct stat st;
+    if (!hist->map)
+        return FALSE;
+    if (fstat(hist->map_fd, &st) == 0 && (guint64)st.st_size >= hist->map_len)
+        return TRUE;
+    history_drop_map_lines(hist, hist->indexed);
+    history_drop_map_lines(hist, hist->shown);
+    if (hist->index_id)
+    {
+        g_source_remove(hist->index_id);
+        hist->index_id = 0;
+    }
+    munmap((void *)hist->map, hist->map_len);
+    close(hist->map_fd);
+    hist->map = NULL;
+    hist->map_fd = -1;
+    hist->scan_pos = 0;
+    return FALSE;
+}
+
+//--- Suggestions ---//
+
+// Makes line `id` of `scores` the best of the trie nodes along its path
+// that it now beats, adding the nodes it lacks.
+static void history_suggest_place(History *hist, guint32 id)
+{
+    const HistoryScore *entry = &g_array_index(hist->scores, HistoryScore, id);
+    double score = entry->score;
+    guint32 node = 0;
+    for (const guchar *p = (const guchar *)entry->text; *p; p++)
+    {
+        HistoryTrieNode *parent = &g_array_index(hist->trie, HistoryTrieNode, node);
+        if (parent->best == G_MAXUINT32 ||
+            (parent->best != id && g_array_index(hist->scores, HistoryScore, parent->best).score < score))
+            parent->best = id;
+        guint32 child = parent->child;
+        while (child && g_array_index(hist->trie, HistoryTrieNode, child).byte != *p)
+            child = g_array_index(hist->trie, HistoryTrieNode, child).next;
+        if (!child)
+        {
+            HistoryTrieNode fresh = {0, parent->child, G_MAXUINT32, *p};
+            child = hist->trie->len;
+            g_array_append_val(hist->trie, fresh); // May move `parent`
+            g_array_index(hist->trie, HistoryTrieNode, node).child = child;
+        }
+        node = child;
+    }
+}
+
+static gint history_score_cmp(gconstpointer a, gconstpointer b)
+{
+    double x = ((const HistoryScore *)a)->score, y = ((const HistoryScore *)b)->score;
+    return (x < y) - (x > y);
+}
+
+// Keeps the HISTORY_SUGGEST_LINES best scoring lines and rebuilds the trie
+// over them alone. Scores only ever rise, so a line dropped had fallen well
+// behind; should it be used again it starts over from that use.
+static void history_suggest_trim(History *hist)
+{
+    GArray *scores = hist->scores;
+    GStringChunk *texts = hist->scored_texts;
+    g_array_sort(scores, history_score_cmp);
+    g_array_set_size(scores, HISTORY_SUGGEST_LINES);
+    hist->scores = g_array_sized_new(FALSE, FALSE, sizeof(HistoryScore), 2 * HISTORY_SUGGEST_LINES);
+    hist->scored_texts = g_string_chunk_new(4096);
+    g_hash_table_remove_all(hist->scored);
+    g_array_set_size(hist->trie, 1);
+    HistoryTrieNode root = {0, 0, G_MAXUINT32, 0};
+    g_array_index(hist->trie, HistoryTrieNode, 0) = root;
+    for (guint i = 0; i < scores->len; i++)
+    {
+        HistoryScore entry = g_array_index(scores, HistoryScore, i);
+        entry.text = g_string_chunk_insert(hist->scored_texts, entry.text);
+        g_array_append_val(hist->scores, entry);
+        g_hash_table_insert(hist->scored, (gpointer)entry.text, GUINT_TO_POINTER(i + 1));
+        history_suggest_place(hist, i);
+    }
+    g_array_free(scores, TRUE);
+    g_string_chunk_free(texts);
+}
+
+// Records a use of `text` at time `when` and updates the trie nodes along
+// its path. Each line scored is copied once; past twice HISTORY_SUGGEST_LINES
+// of them, the worst are dropped.
+static void history_suggest_note(History *hist, const char *text, gint64 when)
+{
+    double use = when / HISTORY_SUGGEST_HALF_LIFE;
+    guint id = GPOINTER_TO_UINT(g_hash_table_lookup(hist->scored, text));
+    if (id)
+    {
+        HistoryScore *entry = &g_array_index(hist->scores, HistoryScore, --id);
+        double hi = MAX(entry->score, use), lo = MIN(entry->score, use);
+        entry->score = hi + log2(1 + exp2(lo - hi));
+        text = entry->text;
+    }
+    else
+    {
+        text = g_string_chunk_insert_len(hist->scored_texts, text, history_line_len(text));
+        HistoryScore entry = {text, use};
+        g_array_append_val(hist->scores, entry);
+        id = hist->scores->len - 1;
+        g_hash_table_insert(hist->scored, (gpointer)text, GUINT_TO_POINTER(id + 1));
+        if (hist->scores->len > 2 * HISTORY_SUGGEST_LINES)
+        {
+            history_suggest_trim(hist);
+            return;
+        }
+    }
+    history_suggest_place(hist, id);
+}
+
+const char *history_suggest(const History *hist, const char *prefix)
+{
+    guint32 node = 0;
+    for (const guchar *p = (const guchar *)prefix; *p; p++)
+    {
+        node = g_array_index(hist->trie, HistoryTrieNode, node).child;
+        while (node && g_array_index(hist->trie, HistoryTrieNode, node).byte != *p)
+            node = g_array_index(hist->trie, HistoryTrieNode, node).next;
+        if (!node)
+            return NULL;
+    }
+    guint32 best = g_array_index(hist->trie, HistoryTrieNode, node).best;
+    return node && best != G_MAXUINT32 ? g_array_index(hist->scores, HistoryScore, best).text : NULL;
+}
+
+//--- Search index ---//
+
+static void history_postings_add(HistoryPostings *list, guint32 id, gboolean newer)
+{
+    if (newer)
+    {
+        if (!list->newer)
+            list->newer = g_array_new(FALSE, FALSE, sizeof(guint32));
+        else if (g_array_index(list->newer, guint32, list->newer->len - 1) == id)
+            return; // Trigram seen before in this line
+        g_array_append_val(list->newer, id);
+    }
+    else
+    {
+        if (list->older && list->older_last == id)
+            return;
+        guint32 gap = (list->older ? list->older_last : G_MAXUINT32) - id;
+        if (!list->older)
+            list->older = g_byte_array_new();
+        guint8 bytes[5];
+        guint n = 0;
+        do
+        {
+            bytes[n++] = (gap & 0x7f) | (gap > 0x7f ? 0x80 : 0);
+            gap >>= 7;
+        } while (gap);
+        g_byte_array_append(list->older, bytes, n);
+        list->older_last = id;
+    }
+    list->n++;
+}
+
+static void history_index_key(History *hist, guint key, guint32 id, gboolean newer)
+{
+    HistoryPostings *list = g_hash_table_lookup(hist->grams, GUINT_TO_POINTER(key));
+    if (!list)
+    {
+        list = g_new0(HistoryPostings, 1);
+        g_hash_table_insert(hist->grams, GUINT_TO_POINTER(key), list);
+    }
+    history_postings_add(list, id, newer);
+}
+
+static void history_index_line(History *hist, guint32 id, const char *text, gboolean newer)
+{
+    history_postings_add(&hist->all, id, newer);
+    gsize len = history_line_len(text);
+    for (gsize i = 0; i + 1 < len; i++)
+    {
+        history_index_key(hist, HISTORY_BIGRAM(text + i), id, newer);
+        if (i + 2 < len)
+            history_index_key(hist, HISTORY_TRIGRAM(text + i), id, newer);
+    }
+}
+
+// history_prev_line(), indexing the line unless a newer copy already is.
+static const char *history_read_line(History *hist)
+{
+    const char *line = history_prev_line(hist);
+    if (line && ++hist->lines_read <= HISTORY_SUGGEST_LINES)
+        history_suggest_note(hist, line, 1 - (gint64)hist->lines_read);
+    if (line && !g_hash_table_contains(hist->indexed, line))
+    {
+        guint32 offset = line - hist->map;
+        g_hash_table_add(hist->indexed, (gpointer)line);
+        g_array_append_val(hist->lines, offset);
+        history_index_line(hist, HISTORY_TAIL_ID - hist->lines->len, line, FALSE);
+    }
+    return line;
+}
+
+static gboolean history_index_cb(gpointer user_data)
+{
+    History *hist = user_data;
+    if (!history_map_usable(hist))
+        return G_SOURCE_REMOVE; // index_id is already cleared
+    gint64 deadline = g_get_monotonic_time() + HISTORY_INDEX_US;
+    for (guint n = 1; history_read_line(hist); n++)
+    {
+        if (n % 256 == 0 && g_get_monotonic_time() >= deadline)
+            return G_SOURCE_CONTINUE;
+    }
+    hist->index_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+// The line with search id `id`, NULL if it was in a map since dropped.
+static const char *history_text(const History *hist, guint32 id)
+{
+    if (id >= HISTORY_TAIL_ID)
+        return g_ptr_array_index(hist->tail, id - HISTORY_TAIL_ID);
+    if (!hist->map)
+        return NULL;
+    return hist->map + g_array_index(hist->lines, guint32, HISTORY_TAIL_ID - 1 - id);
+}
+
+static void history_postings_clear(HistoryPostings *list)
+{
+    if (list->newer)
+        g_array_free(list->newer, TRUE);
+    if (list->older)
+        g_byte_array_free(list->older, TRUE);
+}
+
+static void history_postings_free(gpointer data)
+{
+    history_postings_clear(data);
+    g_free(data);
+}
+
+// Rewrites the `tail` ids in `list` through `renumber`, which maps each old
+// index to a new id or to G_MAXUINT32 for a line since freed. A search
+// under way in the list carries on where it was.
+static void history_postings_renumber(History *hist, HistoryPostings *list, const guint32 *renumber)
+{
+    if (!list->newer)
+        return;
+    guint len = list->newer->len, kept = 0, walk = len;
+    for (guint i = 0; i < len; i++)
+    {
+        if (list == hist->results && i == hist->results_newer)
+            walk = kept;
+        guint32 id = renumber[g_array_index(list->newer, guint32, i) - HISTORY_TAIL_ID];
+        if (id != G_MAXUINT32)
+            g_array_index(list->newer, guint32, kept++) = id;
+    }
+    if (list == hist->results)
+        hist->results_newer = walk == len ? kept : walk;
+    list->n -= len - kept;
+    if (kept)
+        g_array_set_size(list->newer, kept);
+    else
+    {
+        g_array_free(list->newer, TRUE);
+        list->newer = NULL;
+    }
+}
+
+typedef struct
+{
+    History *hist;
+    const guint32 *renumber;
+} HistoryRenumber;
+
+// Also drops lists left empty, unless a search is walking them.
+static gboolean history_postings_renumber_cb(gpointer key, gpointer value, gpointer user_data)
+{
+    HistoryRenumber *r = user_data;
+    HistoryPostings *list = value;
+    history_postings_renumber(r->hist, list, r->renumber);
+    return list->n == 0 && list != r->hist->results;
+}
+
+// Squeezes the freed slots out of `tail`. Lines keep their order, so ids
+// still grow with time.
+static void history_compact_tail(History *hist)
+{
+    guint32 *renumber = g_new(guint32, hist->tail->len);
+    guint kept = 0;
+    for (guint i = 0; i < hist->tail->len; i++)
+    {
+        char *entry = g_ptr_array_index(hist->tail, i);
+        renumber[i] = entry ? HISTORY_TAIL_ID + kept : G_MAXUINT32;
+        if (!entry)
+            continue;
+        g_ptr_array_index(hist->tail, i) = NULL;
+        g_ptr_array_index(hist->tail, kept++) = entry;
+        g_hash_table_insert(hist->tail_ids, entry, GUINT_TO_POINTER(kept));
+    }
+    g_ptr_array_set_size(hist->tail, kept);
+    hist->tail_freed = 0;
+    HistoryRenumber r = {hist, renumber};
+    history_postings_renumber(hist, &hist->all, renumber);
+    g_hash_table_foreach_remove(hist->grams, history_postings_renumber_cb, &r);
+    g_free(renumber);
+}
+
+//--- Ring ---//
+
+static guint history_slot(const History *hist, guint pos)
+{
+    return (hist->head + pos) % hist->cap;
+}
+
+static guint history_index_lookup(const History *hist, const char *entry)
+{
+    return GPOINTER_TO_UINT(g_hash_table_lookup(hist->index, entry));
+}
+
+// Frees a line added since opening that has left the ring. Search stops
+// finding it; lines loaded at startup stay in `texts` and the index.
+static void history_release(History *hist, char *entry)
+{
+    guint id = GPOINTER_TO_UINT(g_hash_table_lookup(hist->tail_ids, entry));
+    if (!id)
+        return;
+    g_hash_table_remove(hist->tail_ids, entry);
+    gpointer key;
+    if (g_hash_table_lookup_extended(hist->indexed, entry, &key, NULL) && key == entry)
+        g_hash_table_remove(hist->indexed, entry);
+    if (g_hash_table_lookup_extended(hist->shown, entry, &key, NULL) && key == entry)
+        g_hash_table_remove(hist->shown, entry);
+    g_ptr_array_index(hist->tail, id - 1) = NULL;
+    hist->tail_freed++;
+    g_free(entry);
+}
+
+// Empties a slot, leaving a hole.
+static void history_forget(History *hist, guint slot)
+{
+    char *entry = hist->ring[slot];
+    if (history_index_lookup(hist, entry) == slot + 1)
+        g_hash_table_remove(hist->index, entry);
+    hist->ring[slot] = NULL;
+    hist->live--;
+    history_release(hist, entry);
+}
+
+// Slides the entries down over the holes, keeping their order.
+static void history_compact(History *hist)
+{
+    guint kept = 0, cursor = hist->count;
+    for (guint pos = 0; pos < hist->count; pos++)
+    {
+        guint from = history_slot(hist, pos);
+        char *entry = hist->ring[from];
+        if (pos == hist->cursor)
+            cursor = kept;
+        if (!entry)
+            continue;
+        guint to = history_slot(hist, kept++);
+        if (to != from)
+        {
+            hist->ring[to] = entry;
+            hist->ring[from] = NULL;
+            if (history_index_lookup(hist, entry) == from + 1)
+                g_hash_table_insert(hist->index, entry, GUINT_TO_POINTER(to + 1));
+        }
+    }
+    hist->cursor = cursor == hist->count ? kept : cursor;
+    hist->count = kept;
+}
+
+// Appends an entry the caller has already checked against ignoredups.
+static void history_push(History *hist, char *entry)
+{
+    gboolean browsing = hist->cursor < hist->count;
+    guint older = history_index_lookup(hist, entry);
+    if (older && hist->dups == HISTORY_ERASE_DUPS)
+        history_forget(hist, older - 1);
+    if (hist->count == hist->cap)
+    {
+        guint holes = hist->count - hist->live;
+        if (holes > 0 && holes >= hist->cap / 4)
+            history_compact(hist);
+        else
+        {
+            if (hist->ring[hist->head])
+                history_forget(hist, hist->head);
+            hist->head = (hist->head + 1) % hist->cap;
+            hist->count--;
+            if (hist->cursor > 0)
+                hist->cursor--;
+        }
+    }
+    guint slot = history_slot(hist, hist->count++);
+    hist->ring[slot] = entry;
+    hist->live++;
+    g_hash_table_replace(hist->index, entry, GUINT_TO_POINTER(slot + 1));
+    if (!browsing)
+        hist->cursor = hist->count;
+}
+
+static const char *history_newest(const History *hist)
+{
+    for (guint pos = hist->count; pos > 0; pos--)
+    {
+        const char *entry = hist->ring[history_slot(hist, pos - 1)];
+        if (entry)
+            return entry;
+    }
+    return NULL;
+}
+
+//--- Writing ---//
+
+static gboolean history_sync_cb(gpointer user_data)
+{
+    History *hist = user_data;
+    hist->sync_id = 0;
+    if (hist->fd != -1 && hist->unsynced)
+        fdatasync(hist->fd);
+    hist->unsynced = FALSE;
+    return G_SOURCE_REMOVE;
+}
+
+void history_flush(History *hist)
+{
+    if (hist->flush_id)
+    {
+        g_source_remove(hist->flush_id);
+        hist->flush_id = 0;
+    }
+    if (hist->fd == -1 || hist->pending->len == 0)
+        return;
+    // One write() per batch: with O_APPEND it lands whole at the end even
+    // when another shell is appending too.
+    gsize done = 0;
+    while (done < hist->pending->len)
+    {
+        ssize_t n = write(hist->fd, hist->pending->str + done, hist->pending->len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break; // Disk full or similar: drop the batch rather than retry forever
+        done += n;
+        // An O_APPEND write leaves the offset at the end of what it wrote,
+        // wherever other windows' lines put that.
+        off_t end = lseek(hist->fd, 0, SEEK_CUR);
+        if (hist->inotify_fd != -1 && end >= n)
+        {
+            HistoryRange range = {end - n, end};
+            g_array_append_val(hist->own, range);
+        }
+    }
+    g_string_truncate(hist->pending, 0);
+    hist->unsynced = TRUE;
+    if (!hist->sync_id)
+        hist->sync_id = g_timeout_add(HISTORY_SYNC_MS, history_sync_cb, hist);
+}
+
+static gboolean history_flush_cb(gpointer user_data)
+{
+    History *hist = user_data;
+    hist->flush_id = 0;
+    history_flush(hist);
+    return G_SOURCE_REMOVE;
+}
+
+// Adds a line typed here or in another window, taking ownership of it.
+// Returns FALSE, having freed it, if it repeats the newest entry and
+// repeats are not kept.
+static gboolean history_record(History *hist, char *entry)
+{
+    const char *last = history_newest(hist);
+    if (hist->dups != HISTORY_KEEP_DUPS && last && strcmp(last, entry) == 0)
+    {
+        history_suggest_note(hist, last, ++hist->uses); // Still a use
+        g_free(entry);
+        return FALSE;
+    }
+    history_suggest_note(hist, entry, ++hist->uses);
+    g_ptr_array_add(hist->tail, entry);
+    g_hash_table_insert(hist->tail_ids, entry, GUINT_TO_POINTER(hist->tail->len));
+    history_push(hist, entry);
+    g_hash_table_add(hist->indexed, entry);
+    history_index_line(hist, HISTORY_TAIL_ID + hist->tail->len - 1, entry, TRUE);
+    if (hist->tail_freed >= HISTORY_TAIL_SLACK && hist->tail_freed >= hist->tail->len / 2)
+        history_compact_tail(hist);
+    return TRUE;
+}
+
+void history_add(History *hist, const char *line)
+{
+    if (!*line)
+        return;
+    // One line per entry in the file, so a pasted newline becomes a space.
+    char *entry = g_strdup(line);
+    g_strdelimit(entry, "\n", ' ');
+    hist->cursor = hist->count;
+    if (!history_record(hist, entry))
+        return;
+
+    g_string_append(hist->pending, entry);
+    g_string_append_c(hist->pending, '\n');
+    if (hist->pending->len >= HISTORY_FLUSH_BYTES)
+        history_flush(hist);
+    else if (!hist->flush_id)
+        hist->flush_id = g_timeout_add(HISTORY_FLUSH_MS, history_flush_cb, hist);
+}
+
+//--- Sharing between windows ---//
+
+// TRUE if this process wrote the line starting at `start`. Own ranges come
+// in file order and lines are read in order, so passed ones are dropped.
+static gboolean history_own_line(History *hist, guint64 start)
+{
+    guint passed = 0;
+    while (passed < hist->own->len && g_array_index(hist->own, HistoryRange, passed).end <= start)
+        passed++;
+    g_array_remove_range(hist->own, 0, passed);
+    return hist->own->len && g_array_index(hist->own, HistoryRange, 0).start <= start;
+}
+
+// Reads whatever the file gained since read_pos and records the lines
+// other windows wrote. A line still being written waits for the next call.
+static void history_merge_new(History *hist)
+{
+    struct stat st;
+    if (fstat(hist->fd, &st) != 0)
+        return;
+    if ((guint64)st.st_size < hist->read_pos)
+    {
+        // Truncated behind our back: go on from its new end.
+        history_map_usable(hist);
+        hist->read_pos = st.st_size;
+        g_array_set_size(hist->own, 0);
+        return;
+    }
+    char buf[HISTORY_MERGE_CHUNK];
+    GString *line = g_string_new(NULL); // The bytes from read_pos on
+    guint64 pos = hist->read_pos;
+    while (pos < (guint64)st.st_size)
+    {
+        ssize_t n = pread(hist->fd, buf, MIN(sizeof(buf), st.st_size - pos), pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        pos += n;
+        const char *p = buf, *end = buf + n, *nl;
+        while ((nl = memchr(p, '\n', end - p)) != NULL)
+        {
+            g_string_append_len(line, p, nl - p);
+            if (line->len > 0 && !history_own_line(hist, hist->read_pos))
+                history_record(hist, g_strndup(line->str, line->len));
+            hist->read_pos += line->len + 1;
+            g_string_truncate(line, 0);
+            p = nl + 1;
+        }
+        g_string_append_len(line, p, end - p);
+    }
+    g_string_free(line, TRUE);
+}
+
+static gboolean history_inotify_cb(gint fd, GIOCondition condition, gpointer user_data)
+{
+    History *hist = user_data;
+    char events[4096];
+    while (read(fd, events, sizeof(events)) > 0)
+        ;
+    history_merge_new(hist);
+    return G_SOURCE_CONTINUE;
+}
+
+static void history_watch(History *hist, const char *path)
+{
+    hist->inotify_fd = -1;
+    hist->own = g_array_new(FALSE, FALSE, sizeof(HistoryRange));
+    if (hist->fd == -1)
+        return;
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1)
+        return;
+    if (inotify_add_watch(fd, path, IN_MODIFY) == -1)
+    {
+        close(fd);
+        return;
+    }
+    hist->inotify_fd = fd;
+    hist->inotify_id = g_unix_fd_add(fd, G_IO_IN, history_inotify_cb, hist);
+    // Catch lines another window added since the file was mapped.
+    history_merge_new(hist);
+}
+
+//--- Opening and browsing ---//
+
+History *history_open(const char *path, guint max_entries, HistoryDups dups)
+{
+    History *hist = g_new0(History, 1);
+    hist->cap = MAX(max_entries, 1);
+    hist->ring = g_new0(char *, hist->cap);
+    hist->index = g_hash_table_new(history_line_hash, history_line_equal);
+    hist->dups = dups;
+    hist->tail = g_ptr_array_new_with_free_func(g_free);
+    hist->tail_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+    hist->texts = g_string_chunk_new(4096);
+    hist->grams = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, history_postings_free);
+    hist->indexed = g_hash_table_new(history_line_hash, history_line_equal);
+    hist->lines = g_array_new(FALSE, FALSE, sizeof(guint32));
+    HistoryTrieNode root = {0, 0, G_MAXUINT32, 0};
+    hist->trie = g_array_new(FALSE, FALSE, sizeof(HistoryTrieNode));
+    g_array_append_val(hist->trie, root);
+    hist->scores = g_array_new(FALSE, FALSE, sizeof(HistoryScore));
+    hist->scored = g_hash_table_new(history_line_hash, history_line_equal);
+    hist->scored_texts = g_string_chunk_new(4096);
+    hist->shown = g_hash_table_new(history_line_hash, history_line_equal);
+    hist->pending = g_string_new(NULL);
+    history_map_file(hist, path);
+    hist->fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+
+    // Newest first from the map, filling the ring from its last slot down.
+    // Reading backwards, the first copy of a line met is its newest, so
+    // erasedups just skips lines already indexed.
+    const char *line;
+    char *newer = NULL;
+    while (hist->count < hist->cap && (line = history_read_line(hist)) != NULL)
+    {
+        gboolean seen = g_hash_table_contains(hist->index, line);
+        if ((seen && dups == HISTORY_ERASE_DUPS) ||
+            (newer && dups == HISTORY_IGNORE_DUPS && history_line_equal(line, newer)))
+            continue;
+        guint slot = hist->cap - 1 - hist->count++;
+        hist->ring[slot] = newer = g_string_chunk_insert_len(hist->texts, line, history_line_len(line));
+        if (!seen)
+            g_hash_table_insert(hist->index, newer, GUINT_TO_POINTER(slot + 1));
+    }
+    hist->head = (hist->cap - hist->count) % hist->cap;
+    hist->live = hist->cursor = hist->count;
+    if (hist->scan_pos > 0)
+        hist->index_id = g_idle_add_full(G_PRIORITY_LOW, history_index_cb, hist, NULL);
+    history_watch(hist, path);
+    return hist;
+}
+
+void history_set_dups(History *hist, HistoryDups dups)
+{
+    hist->dups = dups;
+}
+
+HistoryDups history_get_dups(const History *hist)
+{
+    return hist->dups;
+}
+
+guint history_length(const History *hist)
+{
+    return hist->live;
+}
+
+const char *history_iter(const History *hist, guint *pos)
+{
+    while (*pos < hist->count)
+    {
+        const char *entry = hist->ring[history_slot(hist, (*pos)++)];
+        if (entry)
+            return entry;
+    }
+    return NULL;
+}
+
+const char *history_older(History *hist)
+{
+    for (guint pos = hist->cursor; pos > 0; pos--)
+    {
+        const char *entry = hist->ring[history_slot(hist, pos - 1)];
+        if (entry)
+        {
+            hist->cursor = pos - 1;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+const char *history_newer(History *hist)
+{
+    for (guint pos = hist->cursor + 1; pos < hist->count; pos++)
+    {
+        const char *entry = hist->ring[history_slot(hist, pos)];
+        if (entry)
+        {
+            hist->cursor = pos;
+            return entry;
+        }
+    }
+    hist->cursor = hist->count;
+    return NULL;
+}
+
+void history_reset_cursor(History *hist)
+{
+    hist->cursor = hist->count;
+}
+
+//--- Search ---//
+
+void history_search_start(History *hist, const char *query)
+{
+    g_free(hist->query);
+    hist->query = g_strdup(query);
+    hist->query_len = strlen(query);
+    g_hash_table_remove_all(hist->shown);
+
+    // Only lines holding every trigram of the query can match; walking
+    // the shortest of their postings and checking each line is enough.
+    hist->results = hist->query_len ? &hist->all : NULL;
+    if (hist->query_len == 2)
+        hist->results = g_hash_table_lookup(hist->grams, GUINT_TO_POINTER(HISTORY_BIGRAM(query)));
+    for (gsize i = 0; hist->results && i + 3 <= hist->query_len; i++)
+    {
+        HistoryPostings *list = g_hash_table_lookup(hist->grams, GUINT_TO_POINTER(HISTORY_TRIGRAM(query + i)));
+        if (!list || list->n < hist->results->n || hist->results == &hist->all)
+            hist->results = list;
+    }
+    if (hist->results)
+    {
+        hist->results_newer = hist->results->newer ? hist->results->newer->len : 0;
+        hist->results_older = 0;
+        hist->results_id = G_MAXUINT32;
+    }
+}
+
+// The next id in hist->results, newest first, or FALSE at the end.
+static gboolean history_search_step(History *hist, guint32 *id)
+{
+    HistoryPostings *list = hist->results;
+    if (hist->results_newer > 0)
+    {
+        *id = g_array_index(list->newer, guint32, --hist->results_newer);
+        return TRUE;
+    }
+    if (!list->older || hist->results_older >= list->older->len)
+        return FALSE;
+    guint32 gap = 0;
+    guint shift = 0;
+    guint8 byte;
+    do
+    {
+        byte = list->older->data[hist->results_older++];
+        gap |= (guint32)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    *id = hist->results_id -= gap;
+    return TRUE;
+}
+
+const char *history_search_next(History *hist, gsize *match)
+{
+    guint32 id;
+    history_map_usable(hist);
+    while (hist->results && history_search_step(hist, &id))
+    {
+        const char *text = history_text(hist, id);
+        if (!text)
+            continue;
+        gsize len = history_line_len(text);
+        const char *found = memmem(text, len, hist->query, hist->query_len);
+        if (found && !g_hash_table_contains(hist->shown, text))
+        {
+            g_hash_table_add(hist->shown, (gpointer)text);
+            g_free(hist->found);
+            hist->found = g_strndup(text, len);
+            *match = found - text;
+            return hist->found;
+        }
+    }
+    return NULL;
+}
+
+void history_close(History *hist)
+{
+    if (!hist)
+        return;
+    history_flush(hist);
+    if (hist->sync_id)
+        g_source_remove(hist->sync_id);
+    history_sync_cb(hist);
+    if (hist->fd != -1)
+        close(hist->fd);
+    if (hist->inotify_id)
+        g_source_remove(hist->inotify_id);
+    if (hist->inotify_fd != -1)
+        close(hist->inotify_fd);
+    g_array_free(hist->own, TRUE);
+    if (hist->index_id)
+        g_source_remove(hist->index_id);
+    g_free(hist->ring);
+    g_hash_table_destroy(hist->index);
+    g_ptr_array_free(hist->tail, TRUE);
+    g_hash_table_destroy(hist->tail_ids);
+    g_hash_table_destroy(hist->grams);
+    history_postings_clear(&hist->all);
+    g_hash_table_destroy(hist->indexed);
+    g_array_free(hist->lines, TRUE);
+    g_array_free(hist->trie, TRUE);
+    g_array_free(hist->scores, TRUE);
+    g_hash_table_destroy(hist->scored);
+    g_string_chunk_free(hist->scored_texts);
+    g_hash_table_destroy(hist->shown);
+    g_free(hist->found);
+    g_free(hist->query);
+    g_string_chunk_free(hist->texts);
+    if (hist->map)
+    {
+        munmap((void *)hist->map, hist->map_len);
+        close(hist->map_fd);
+    }
+    g_string_free(hist->pending, TRUE);
+    g_free(hist);
+}
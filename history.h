@@ -0,0 +1,67 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+// Command history: an append-only log file, the entries Up/Down walk
+// through and a search index over the whole file. GLib only, no GTK.
+
+#include <glib.h>
+
+typedef struct History History;
+
+// What happens when a line is already in history, as in bash's HISTCONTROL.
+typedef enum
+{
+    HISTORY_KEEP_DUPS,   // Record every line
+    HISTORY_IGNORE_DUPS, // Skip a line equal to the newest entry
+    HISTORY_ERASE_DUPS,  // Also drop older copies, keeping only the newest
+} HistoryDups;
+
+// Opens (or creates) the log at `path` and loads its newest lines, at most
+// `max_entries` of them, which is also the most ever kept. Never fails:
+// without a usable file, history just isn't saved. Lines other windows
+// append to the same file are picked up as they are written.
+History *history_open(const char *path, guint max_entries, HistoryDups dups);
+// Writes out anything batched, syncs the file and frees everything.
+void history_close(History *hist);
+
+// Records a command line and ends any Up/Down browsing. The file write is
+// batched and its fsync deferred. The oldest entry is dropped when full.
+void history_add(History *hist, const char *line);
+// Writes batched lines now; the fsync still waits for its timer.
+void history_flush(History *hist);
+
+// Applies to lines added from now on; older duplicates are left alone.
+void history_set_dups(History *hist, HistoryDups dups);
+HistoryDups history_get_dups(const History *hist);
+
+guint history_length(const History *hist);
+// Walks the entries oldest first: start with *pos at 0, NULL after the
+// newest. Entries returned here and below are valid until history_add().
+const char *history_iter(const History *hist, guint *pos);
+
+// Up/Down. history_older() steps back from the input line and returns NULL
+// at the oldest entry; history_newer() returns NULL once it is back past
+// the newest, at the input line again.
+const char *history_older(History *hist);
+const char *history_newer(History *hist);
+// Back to the input line, as when a command is entered or Ctrl+C pressed.
+void history_reset_cursor(History *hist);
+
+// Ctrl+R. Starts a search for lines containing `query` (case-sensitive);
+// history_search_next() then returns matches newest first, each text only
+// once, with *match set to the byte offset of the query in it. It returns
+// NULL when there are no more; each text returned is valid until the next
+// call. The file as it was at startup is searched whole, not just the
+// entries Up/Down reach, though its oldest lines are only indexed in idle
+// time shortly after startup. Lines added since are found while Up/Down
+// still reaches them.
+void history_search_start(History *hist, const char *query);
+const char *history_search_next(History *hist, gsize *match);
+
+// Autosuggestion: the line starting with `prefix` and going on past it that
+// has been used most, recent uses counting more, or NULL. Costs one step
+// per byte of `prefix`, so it can run on every keystroke. The line is
+// valid until the next history_add().
+const char *history_suggest(const History *hist, const char *prefix);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef HORIZON_PLUGIN_H
+#define HORIZON_PLUGIN_H
+
+// Builtin plugins for HorizonShell.
+//
+// A plugin is a shared object exporting horizon_plugin_init(). The shell
+// calls it once after dlopen(), and the plugin registers its builtins
+// through the host table. Builtins then run in the shell process like the
+// core ones, with no fork or exec. Everything goes through the table, so a
+// plugin needs only this header and never links against the shell.
+//
+//     #include "horizon_plugin.h"
+//
+//     static int hello(const HorizonHost *host, int argc, char **argv)
+//     {
+//         host->append_text(host->shell, "hello\n", NULL);
+//         return 0;
+//     }
+//
+//     int horizon_plugin_init(const HorizonHost *host)
+//     {
+//         if (host->abi_version != HORIZON_PLUGIN_ABI)
+//             return -1;
+//         return host->register_builtin(host->shell, "hello", hello, "hello", "Says hello.");
+//     }
+//
+//     gcc -shared -fPIC -o hello.so hello.c
+//
+// Plugins in ~/.config/horizonshell/plugins are loaded at startup; `load
+// <file.so>` loads one later. Plugins are never unloaded.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bumped when a change would break existing plugins. New members are only
+// ever added to the end of HorizonHost, and `size` tells which exist.
+#define HORIZON_PLUGIN_ABI 1
+
+typedef struct HorizonShell HorizonShell; // Opaque
+typedef struct HorizonHost HorizonHost;
+
+// Runs the builtin; argv[0] is its name and argv[argc] is NULL. Returns the
+// command's exit status: 0 for success, anything else counts as failure.
+// Runs on the GUI thread: nothing else runs and the window is not redrawn
+// until it returns, so keep it short and let long loops poll cancelled().
+typedef int (*HorizonBuiltinFunc)(const HorizonHost *host, int argc, char **argv);
+
+struct HorizonHost
+{
+    unsigned abi_version; // HORIZON_PLUGIN_ABI of the shell
+    size_t size;          // sizeof(HorizonHost) in the shell
+    HorizonShell *shell;
+
+    // Only valid during horizon_plugin_init(). `usage` and `help` are shown
+    // by `help`, e.g. "greet <name>" and "Greets someone.", and are copied.
+    // Returns 0, or -1 if the name is empty or belongs to a core builtin.
+    int (*register_builtin)(HorizonShell *shell, const char *name, HorizonBuiltinFunc func,
+                            const char *usage, const char *help);
+
+    // Prints UTF-8 text in the terminal. `tag` is NULL for plain output,
+    // "error" (red; also makes the command fail) or "highlight".
+    void (*append_text)(HorizonShell *shell, const char *text, const char *tag);
+
+    // Nonzero once Ctrl+C has been pressed. It only looks at queued input,
+    // without running anything else, so it is cheap to call often.
+    int (*cancelled)(HorizonShell *shell);
+};
+
+// Exported by every plugin. Returns 0 on success; anything else unloads the
+// plugin and discards what it registered.
+int horizon_plugin_init(const HorizonHost *host);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
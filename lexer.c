@@ -0,0 +1,283 @@
+#include "lexer.h"
+
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_ALIGN alignof(max_align_t)
+
+struct ArenaBlock
+{
+    ArenaBlock *next;
+    size_t used, size;
+    alignas(max_align_t) char data[];
+};
+
+//--- Arena ---//
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    if (size > (size_t)-1 / 2)
+    {
+        fputs("arena: allocation too large\n", stderr);
+        abort();
+    }
+    size = size ? (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1) : ARENA_ALIGN;
+    ArenaBlock *block = arena->head;
+    if (!block || block->size - block->used < size)
+    {
+        size_t cap = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        // calloc'd and never reused, so every allocation comes back zeroed.
+        ArenaBlock *fresh = calloc(1, sizeof(ArenaBlock) + cap);
+        if (!fresh)
+        {
+            fputs("arena: out of memory\n", stderr);
+            abort();
+        }
+        fresh->size = cap;
+        if (block && cap > ARENA_BLOCK_SIZE)
+        {
+            // A one-off big block goes behind the current one, whose free
+            // space is still good for the small allocations after it.
+            fresh->next = block->next;
+            block->next = fresh;
+            fresh->used = size;
+            return fresh->data;
+        }
+        fresh->next = block;
+        arena->head = block = fresh;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+char *arena_strndup(Arena *arena, const char *str, size_t len)
+{
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+char *arena_strdup(Arena *arena, const char *str)
+{
+    return arena_strndup(arena, str, strlen(str));
+}
+
+void arena_free(Arena *arena)
+{
+    ArenaBlock *block = arena->head;
+    while (block)
+    {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+}
+
+//--- Lexer ---//
+
+typedef struct
+{
+    Arena *arena;
+    LexToken *tokens;
+    size_t n, cap;
+} TokenList;
+
+static const char *const lex_names[] = {
+    "word", "|", "||", "&", "&&", ";", "(", ")", "<", ">", ">>", "2>", "2>>", "2>&1", "&>", "&>>", "newline"};
+
+const char *lex_type_name(LexType type)
+{
+    return lex_names[type];
+}
+
+int lex_is_redirection(LexType type)
+{
+    return type >= LEX_LESS && type <= LEX_ALL_DGREAT;
+}
+
+static int is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static int is_operator_char(char c)
+{
+    return c == '|' || c == '&' || c == ';' || c == '(' || c == ')' || c == '<' || c == '>';
+}
+
+static LexToken *push_token(TokenList *list, LexType type, size_t start, size_t end)
+{
+    if (list->n == list->cap)
+    {
+        // The old array stays in the arena; doubling keeps that waste to
+        // no more than the final array.
+        size_t cap = list->cap ? list->cap * 2 : 16;
+        LexToken *tokens = arena_alloc(list->arena, cap * sizeof(LexToken));
+        if (list->n)
+            memcpy(tokens, list->tokens, list->n * sizeof(LexToken));
+        list->tokens = tokens;
+        list->cap = cap;
+    }
+    LexToken *tok = &list->tokens[list->n++];
+    tok->type = type;
+    tok->start = start;
+    tok->end = end;
+    return tok;
+}
+
+// Longest operator at the start of `s`; returns its length, 0 if there is
+// none. Only called where a token starts, so `2>` is never part of a word.
+static size_t match_operator(const char *s, LexType *type)
+{
+    switch (s[0])
+    {
+    case '|':
+        *type = s[1] == '|' ? LEX_OR : LEX_PIPE;
+        return *type == LEX_OR ? 2 : 1;
+    case '&':
+        if (s[1] == '&')
+            return *type = LEX_AND, 2;
+        if (s[1] == '>')
+            return s[2] == '>' ? (*type = LEX_ALL_DGREAT, 3) : (*type = LEX_ALL_GREAT, 2);
+        return *type = LEX_AMP, 1;
+    case ';':
+        return *type = LEX_SEMI, 1;
+    case '(':
+        return *type = LEX_LPAREN, 1;
+    case ')':
+        return *type = LEX_RPAREN, 1;
+    case '<':
+        return *type = LEX_LESS, 1;
+    case '>':
+        return s[1] == '>' ? (*type = LEX_DGREAT, 2) : (*type = LEX_GREAT, 1);
+    case '2':
+        if (s[1] != '>')
+            return 0;
+        if (s[2] == '&' && s[3] == '1')
+            return *type = LEX_ERR_TO_OUT, 4;
+        return s[2] == '>' ? (*type = LEX_ERR_DGREAT, 3) : (*type = LEX_ERR_GREAT, 2);
+    }
+    return 0;
+}
+
+// Appends one byte to the current word, and to its glob pattern when the
+// line has one: quoted *?[]\ get a backslash there to keep them literal.
+static void put_char(char **out, char **pat, char c, int quoted)
+{
+    *(*out)++ = c;
+    if (*pat)
+    {
+        if (quoted && strchr("*?[]\\", c))
+            *(*pat)++ = '\\';
+        *(*pat)++ = c;
+    }
+}
+
+// Quoting follows sh: '...' is literal, "..." keeps backslash special only
+// before \ " $ ` and newline, and an unquoted backslash escapes any byte.
+// Backslash-newline disappears in both places.
+ssize_t lex_line(Arena *arena, const char *line, LexToken **tokens, const char **error)
+{
+    size_t len = strlen(line);
+    // Unquoting never makes a word longer, and every word but the last is
+    // followed by a separator byte that makes room for its NUL, so one
+    // buffer the size of the line holds the text of every word.
+    char *out = arena_alloc(arena, len + 1);
+    // Patterns are built alongside the text only if the line could have
+    // one. Escaping at most doubles a word, so twice the line is enough.
+    char *pat = strpbrk(line, "*?[") ? arena_alloc(arena, 2 * len + 2) : NULL;
+    TokenList list = {.arena = arena};
+    size_t i = 0;
+    for (;;)
+    {
+        while (is_blank(line[i]))
+            i++;
+        if (line[i] == '\0')
+            break;
+
+        LexType type;
+        size_t op_len = match_operator(line + i, &type);
+        if (op_len)
+        {
+            push_token(&list, type, i, i + op_len);
+            i += op_len;
+            continue;
+        }
+
+        LexToken *tok = push_token(&list, LEX_WORD, i, i);
+        tok->text = out;
+        char *pat_start = pat;
+        while (line[i] && !is_blank(line[i]) && !is_operator_char(line[i]))
+        {
+            char c = line[i];
+            if (c == '\\')
+            {
+                tok->flags |= LEX_QUOTED;
+                if (line[i + 1] == '\0')
+                    put_char(&out, &pat, line[i++], 1); // Nothing to escape: keep it
+                else
+                {
+                    if (line[i + 1] != '\n')
+                        put_char(&out, &pat, line[i + 1], 1);
+                    i += 2;
+                }
+            }
+            else if (c == '\'')
+            {
+                const char *close = strchr(line + i + 1, '\'');
+                if (!close)
+                {
+                    *error = "missing closing '";
+                    return -1;
+                }
+                for (i++; line + i < close; i++)
+                    put_char(&out, &pat, line[i], 1);
+                i++;
+                tok->flags |= LEX_QUOTED;
+            }
+            else if (c == '"')
+            {
+                for (i++; line[i] != '"'; i++)
+                {
+                    if (line[i] == '\0')
+                    {
+                        *error = "missing closing \"";
+                        return -1;
+                    }
+                    if (line[i] == '\\' && line[i + 1] && strchr("\\\"$`\n", line[i + 1]))
+                    {
+                        if (line[++i] == '\n')
+                            continue;
+                    }
+                    put_char(&out, &pat, line[i], 1);
+                }
+                i++;
+                tok->flags |= LEX_QUOTED;
+            }
+            else
+            {
+                if (c == '*' || c == '?' || c == '[')
+                    tok->flags |= LEX_GLOB;
+                put_char(&out, &pat, c, 0);
+                i++;
+            }
+        }
+        *out++ = '\0';
+        tok->end = i;
+        if (tok->flags & LEX_GLOB)
+        {
+            *pat++ = '\0';
+            tok->pattern = pat_start;
+        }
+        else
+            pat = pat_start;
+    }
+    push_token(&list, LEX_END, len, len);
+    *tokens = list.tokens;
+    return (ssize_t)list.n;
+}
@@ -0,0 +1,74 @@
+#ifndef LEXER_H
+#define LEXER_H
+
+// Command line lexer. Plain C with no GLib, so it can be built and fuzzed
+// on its own.
+
+#include <stddef.h>
+#include <sys/types.h>
+
+//--- Arena ---//
+// Bump allocator: everything allocated for one command line goes into the
+// same arena and is released together by arena_free().
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct
+{
+    ArenaBlock *head; // Block being filled, older ones behind it
+} Arena;
+
+// Returns zeroed memory; aborts when out of memory, like g_malloc().
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strndup(Arena *arena, const char *str, size_t len);
+char *arena_strdup(Arena *arena, const char *str);
+// Frees every allocation at once; the arena can be reused afterwards.
+void arena_free(Arena *arena);
+
+//--- Tokens ---//
+
+typedef enum
+{
+    LEX_WORD,
+    LEX_PIPE,       // |
+    LEX_OR,         // ||
+    LEX_AMP,        // &
+    LEX_AND,        // &&
+    LEX_SEMI,       // ;
+    LEX_LPAREN,     // (
+    LEX_RPAREN,     // )
+    LEX_LESS,       // <
+    LEX_GREAT,      // >
+    LEX_DGREAT,     // >>
+    LEX_ERR_GREAT,  // 2>
+    LEX_ERR_DGREAT, // 2>>
+    LEX_ERR_TO_OUT, // 2>&1
+    LEX_ALL_GREAT,  // &>
+    LEX_ALL_DGREAT, // &>>
+    LEX_END,
+} LexType;
+
+#define LEX_QUOTED 0x1 // Some of the word was quoted or escaped
+#define LEX_GLOB 0x2   // It has an unquoted *, ? or [
+
+typedef struct
+{
+    LexType type;
+    unsigned flags;
+    char *text;        // LEX_WORD: the word with quotes and escapes removed
+    char *pattern;     // LEX_GLOB: the word as a glob, quoted *?[]\ escaped
+    size_t start, end; // Byte range in the line
+} LexToken;
+
+// Splits `line` into tokens allocated in `arena`, the last one LEX_END.
+// Returns the number of tokens, LEX_END included, or -1 with *error set to
+// a static message (an unterminated quote).
+ssize_t lex_line(Arena *arena, const char *line, LexToken **tokens, const char **error);
+
+// How the token is written, for error messages ("newline" for LEX_END).
+const char *lex_type_name(LexType type);
+
+// True for <, >, 2>&1 and the rest; all but LEX_ERR_TO_OUT take a file name.
+int lex_is_redirection(LexType type);
+
+#endif
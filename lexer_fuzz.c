@@ -0,0 +1,183 @@
+// Fuzz and benchmark driver for lex_line() in lexer.c, which needs neither
+// GTK nor GLib.
+//
+//     gcc -O1 -g -fsanitize=address,undefined -o lexer_fuzz lexer_fuzz.c lexer.c
+//     ./lexer_fuzz fuzz [lines] [seed]   random lines, checked (1000000)
+//     ./lexer_fuzz bench [mb]            MB/s on a pasted one-liner (64)
+//
+// With clang, -DLEXER_FUZZ_LIBFUZZER -fsanitize=fuzzer,address builds it
+// for libFuzzer instead; the same checks run on every input.
+
+#include "lexer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void fail(const char *line, size_t i, const char *what)
+{
+    fprintf(stderr, "token %zu: %s\nline (%zu bytes): \"", i, what, strlen(line));
+    for (const char *c = line; *c; c++)
+        fprintf(stderr, *c >= ' ' && *c < 127 && *c != '"' && *c != '\\' ? "%c" : "\\x%02x", (unsigned char)*c);
+    fputs("\"\n", stderr);
+    abort();
+}
+
+// What lex_line() promises: tokens in order, blanks and nothing else
+// between them, a LEX_END at the very end, unquoted words copied as they
+// are, and a pattern exactly when the word has an unquoted *, ? or [ that
+// unescapes back to the word's text.
+static void check_line(const char *line)
+{
+    Arena arena = {0};
+    LexToken *tokens;
+    const char *error = NULL;
+    ssize_t n = lex_line(&arena, line, &tokens, &error);
+    size_t len = strlen(line);
+    if (n < 0)
+    {
+        if (!error || (!strchr(line, '\'') && !strchr(line, '"')))
+            fail(line, 0, "error without an unterminated quote");
+        arena_free(&arena);
+        return;
+    }
+    if (n == 0 || tokens[n - 1].type != LEX_END || tokens[n - 1].start != len)
+        fail(line, (size_t)n, "no LEX_END at the end of the line");
+
+    size_t pos = 0;
+    for (size_t i = 0; i < (size_t)n; i++)
+    {
+        LexToken *tok = &tokens[i];
+        if (tok->start < pos || tok->end < tok->start || tok->end > len)
+            fail(line, i, "byte range out of order");
+        for (; pos < tok->start; pos++)
+            if (!strchr(" \t\n\r\v\f", line[pos]))
+                fail(line, i, "skipped a byte that is not blank");
+        pos = tok->end;
+        if (tok->type != LEX_WORD)
+        {
+            if (tok->type != LEX_END && strlen(lex_type_name(tok->type)) != tok->end - tok->start)
+                fail(line, i, "operator length differs from its name");
+            continue;
+        }
+
+        size_t text_len = strlen(tok->text);
+        if (tok->end == tok->start || text_len > tok->end - tok->start)
+            fail(line, i, "word longer than its source");
+        if (!(tok->flags & LEX_QUOTED) && memcmp(tok->text, line + tok->start, tok->end - tok->start) != 0)
+            fail(line, i, "unquoted word differs from its source");
+        if (!(tok->flags & LEX_GLOB) != !tok->pattern)
+            fail(line, i, "pattern and LEX_GLOB disagree");
+        if (tok->pattern)
+        {
+            char *plain = malloc(strlen(tok->pattern) + 1), *out = plain;
+            for (const char *p = tok->pattern; *p; p++)
+                *out++ = *p == '\\' && p[1] ? *++p : *p;
+            *out = '\0';
+            if (strcmp(plain, tok->text) != 0)
+                fail(line, i, "pattern does not unescape to the text");
+            free(plain);
+        }
+    }
+    arena_free(&arena);
+}
+
+#ifdef LEXER_FUZZ_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    char *line = malloc(size + 1);
+    memcpy(line, data, size);
+    line[size] = '\0';
+    check_line(line);
+    free(line);
+    return 0;
+}
+
+#else
+
+// Mostly bytes the lexer treats specially, so most lines are interesting.
+static const char alphabet[] = "ab2 \t\n\\'\"|&;()<>*?[]1$`";
+
+static uint64_t rng_state;
+
+static uint32_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)rng_state;
+}
+
+static int fuzz(long lines, unsigned long seed)
+{
+    char line[256];
+    rng_state = seed ? seed : 1;
+    for (long i = 0; i < lines; i++)
+    {
+        size_t len = rng_next() % sizeof(line);
+        for (size_t j = 0; j < len; j++)
+        {
+            // One byte in sixteen is arbitrary, UTF-8 and control bytes too.
+            uint32_t r = rng_next();
+            line[j] = r % 16 ? alphabet[(r >> 4) % (sizeof(alphabet) - 1)] : (char)((r >> 4) % 255 + 1);
+        }
+        line[len] = '\0';
+        check_line(line);
+    }
+    printf("%ld lines, seed %lu: ok\n", lines, seed);
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench(long mb)
+{
+    // A long pasted one-liner: every kind of token, quoting and globs.
+    static const char piece[] = "find . -name '*.o' -newer \"$HOME/x y\" | xargs rm -f a\\ b && "
+                                "make -j8 2>&1 > build.log || (echo \"failed: $?\"; cat *.log) ; ";
+    size_t reps = 4096 / (sizeof(piece) - 1);
+    size_t len = reps * (sizeof(piece) - 1);
+    char *line = malloc(len + 1);
+    for (size_t i = 0; i < reps; i++)
+        memcpy(line + i * (sizeof(piece) - 1), piece, sizeof(piece) - 1);
+    line[len] = '\0';
+
+    long runs = (mb << 20) / (long)len;
+    if (runs < 1)
+        runs = 1;
+    size_t tokens = 0;
+    Arena arena = {0};
+    double start = now();
+    for (long i = 0; i < runs; i++)
+    {
+        LexToken *list;
+        const char *error;
+        tokens += (size_t)lex_line(&arena, line, &list, &error);
+        arena_free(&arena);
+    }
+    double secs = now() - start;
+    printf("%zu-byte line x %ld: %.0f MB/s, %.1f M tokens/s\n", len, runs, runs * (double)len / secs / 1048576,
+           tokens / secs / 1e6);
+    free(line);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "fuzz") == 0)
+        return fuzz(argc > 2 ? atol(argv[2]) : 1000000, argc > 3 ? strtoul(argv[3], NULL, 0) : (unsigned long)time(NULL));
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+        return bench(argc > 2 ? atol(argv[2]) : 64);
+    fprintf(stderr, "usage: %s fuzz [lines] [seed] | bench [mb]\n", argv[0]);
+    return 2;
+}
+
+#endif
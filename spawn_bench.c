@@ -0,0 +1,112 @@
+// Launch latency of `true` with plain fork+execve and with posix_spawn, the
+// two paths spawn_process() in v3.c can take. Each launch is timed from the
+// call until waitpid() returns. The process first touches `mb` MB of memory,
+// standing in for the pages a running GTK shell has mapped, since that is
+// what fork has to copy page tables for.
+//
+//     gcc -O2 -o spawn_bench spawn_bench.c
+//     ./spawn_bench [runs] [mb]     (10000 runs, 256 MB)
+
+#define _GNU_SOURCE
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static const char *true_path = "/bin/true";
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static pid_t launch_fork(char **argv)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execve(true_path, argv, environ);
+        _exit(127);
+    }
+    return pid;
+}
+
+static pid_t launch_spawn(char **argv)
+{
+    pid_t pid;
+    return posix_spawn(&pid, true_path, NULL, NULL, argv, environ) == 0 ? pid : -1;
+}
+
+static int compare_times(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static void run(const char *name, pid_t (*launch)(char **), long long *times, int runs)
+{
+    char *argv[] = {"true", NULL};
+    for (int i = 0; i < runs; i++)
+    {
+        long long start = now_ns();
+        pid_t pid = launch(argv);
+        int status;
+        if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "%s: launch %d failed\n", name, i);
+            exit(1);
+        }
+        times[i] = now_ns() - start;
+    }
+    qsort(times, runs, sizeof(*times), compare_times);
+    long long total = 0;
+    for (int i = 0; i < runs; i++)
+        total += times[i];
+    printf("%-12s p50 %6lld us   p99 %6lld us   mean %6lld us\n", name, times[runs / 2] / 1000,
+           times[runs * 99 / 100] / 1000, total / runs / 1000);
+}
+
+int main(int argc, char **argv)
+{
+    int runs = argc > 1 ? atoi(argv[1]) : 10000;
+    long mb = argc > 2 ? atol(argv[2]) : 256;
+    if (runs <= 0 || mb < 0)
+    {
+        fprintf(stderr, "usage: %s [runs] [mb]\n", argv[0]);
+        return 2;
+    }
+    if (access(true_path, X_OK) != 0)
+        true_path = "/usr/bin/true";
+
+    // Small pages, as the shell's heap and libraries mostly are: with huge
+    // pages fork would have far fewer page table entries to copy.
+    size_t size = (size_t)mb << 20;
+    char *ballast = size ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : NULL;
+    if (ballast == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+    if (size)
+    {
+        madvise(ballast, size, MADV_NOHUGEPAGE);
+        memset(ballast, 1, size);
+    }
+
+    long long *times = malloc(runs * sizeof(*times));
+    printf("%d launches of %s, %ld MB resident\n", runs, true_path, mb);
+    run("fork+execve", launch_fork, times, runs);
+    run("posix_spawn", launch_spawn, times, runs);
+    free(times);
+    if (size)
+        munmap(ballast, size);
+    return 0;
+}